@@ -103,76 +103,11 @@ Image make_image_grid(const std::vector<Image>& imgs, int tilex) {
     return ret;
 }
 
-ygl::image4f filter_bilateral(const ygl::image4f& img, float spatial_sigma,
-    float range_sigma, const std::vector<ygl::image4f>& features,
-    const std::vector<float>& features_sigma) {
-    auto filtered = ygl::image4f(img.width(), img.height());
-    auto width = (int)ceil(2.57f * spatial_sigma);
-    auto sw = 1 / (2.0f * spatial_sigma * spatial_sigma);
-    auto rw = 1 / (2.0f * range_sigma * range_sigma);
-    auto fw = std::vector<float>();
-    for (auto feature_sigma : features_sigma)
-        fw.push_back(1 / (2.0f * feature_sigma * feature_sigma));
-    for (auto j = 0; j < img.height(); j++) {
-        for (auto i = 0; i < img.width(); i++) {
-            auto av = ygl::zero4f;
-            auto aw = 0.0f;
-            for (auto fj = -width; fj <= width; fj++) {
-                for (auto fi = -width; fi <= width; fi++) {
-                    auto ii = i + fi, jj = j + fj;
-                    if (ii < 0 || jj < 0) continue;
-                    if (ii >= img.width() || jj >= img.height()) continue;
-                    auto uv = ygl::vec2f{float(i - ii), float(j - jj)};
-                    auto rgb = img.at(i, j) - img.at(ii, jj);
-                    auto w = exp(-dot(uv, uv) * sw) * exp(-dot(rgb, rgb) * rw);
-                    for (auto fi = 0; fi < features.size(); fi++) {
-                        auto feat =
-                            features[fi].at(i, j) - features[fi].at(ii, jj);
-                        w *= exp(-dot(feat, feat) * fw[fi]);
-                    }
-                    av += w * img.at(ii, jj);
-                    aw += w;
-                }
-            }
-            filtered.at(i, j) = av / aw;
-        }
-    }
-    return filtered;
-}
-
-ygl::image4f filter_bilateral(
-    const ygl::image4f& img, float spatial_sigma, float range_sigma) {
-    auto filtered = ygl::image4f(img.width(), img.height());
-    auto width = (int)ceil(2.57f * spatial_sigma);
-    auto sw = 1 / (2.0f * spatial_sigma * spatial_sigma);
-    auto rw = 1 / (2.0f * range_sigma * range_sigma);
-    for (auto j = 0; j < img.height(); j++) {
-        for (auto i = 0; i < img.width(); i++) {
-            auto av = ygl::zero4f;
-            auto aw = 0.0f;
-            for (auto fj = -width; fj <= width; fj++) {
-                for (auto fi = -width; fi <= width; fi++) {
-                    auto ii = i + fi, jj = j + fj;
-                    if (ii < 0 || jj < 0) continue;
-                    if (ii >= img.width() || jj >= img.height()) continue;
-                    auto uv = ygl::vec2f{float(i - ii), float(j - jj)};
-                    auto rgb = img.at(i, j) - img.at(ii, jj);
-                    auto w = exp(-dot(uv, uv) * sw) * exp(-dot(rgb, rgb) * rw);
-                    av += w * img.at(ii, jj);
-                    aw += w;
-                }
-            }
-            filtered.at(i, j) = av / aw;
-        }
-    }
-    return filtered;
-}
-
 int main(int argc, char* argv[]) {
     // command line params
     auto parser = ygl::make_parser(argc, argv, "yimproc", "process images");
     auto command = ygl::parse_arg(parser, "command", "command to execute", ""s,
-        true, {"resize", "tonemap", "bilateral"});
+        true, {"resize", "tonemap", "bilateral", "merge"});
     auto output =
         ygl::parse_opt(parser, "--output", "-o", "output image filename", ""s);
     if (command == "resize") {
@@ -237,9 +172,102 @@ int main(int argc, char* argv[]) {
             features.push_back(load_hdr(ffilename));
             features_sigma.push_back(feature_sigma);
         }
-        auto out = filter_bilateral(
+        auto out = ygl::filter_bilateral(
             img, spatial_sigma, range_sigma, features, features_sigma);
         save_hdr(output, out);
+    } else if (command == "merge") {
+        auto denoise = ygl::parse_flag(
+            parser, "--denoise", "", "denoise using the feature buffers");
+        auto cofilename = ygl::parse_opt(parser, "--cost-image", "",
+            "render time heat map filename", ""s);
+        auto filenames = ygl::parse_args(parser, "partials",
+            "partial render filenames", std::vector<std::string>{}, true);
+        // check parsing
+        if (ygl::should_exit(parser)) {
+            printf("%s\n", get_usage(parser).c_str());
+            exit(1);
+        }
+
+        // load partials of the same image
+        auto partials = std::vector<ygl::trace_buffer>();
+        auto features = false, cost = false;
+        for (auto filename : filenames) {
+            try {
+                partials.push_back(ygl::load_trace_buffer(filename));
+            } catch (const std::exception& e) {
+                ygl::log_fatal("cannot load partial {}", filename);
+            }
+            auto& partial = partials.back();
+            if (partial.params_hash != partials.front().params_hash)
+                ygl::log_fatal(
+                    "partial {} was rendered with different params", filename);
+            if (partial.image_width != partials.front().image_width ||
+                partial.image_height != partials.front().image_height)
+                ygl::log_fatal(
+                    "partial {} was rendered at a different size", filename);
+            if (denoise && partial.albedo.empty())
+                ygl::log_fatal("partial {} has no features to denoise with",
+                    filename);
+            features = features || !partial.albedo.empty();
+            cost = cost || !partial.cost.empty();
+        }
+        auto size = ygl::vec2i{
+            partials.front().image_width, partials.front().image_height};
+
+        // sample ranges of each pixel must follow each other from the first
+        // sample, so partials in order of their first sample must start
+        // where the previous ones ended
+        auto order = std::vector<int>();
+        for (auto pid = 0; pid < partials.size(); pid++) order.push_back(pid);
+        std::stable_sort(
+            order.begin(), order.end(), [&partials](int a, int b) {
+                return partials[a].sample_start < partials[b].sample_start;
+            });
+        auto reached = std::vector<int>((size_t)size.x * size.y, 0);
+        for (auto pid : order) {
+            auto& partial = partials[pid];
+            auto ntiles = partial.ntiles();
+            for (auto pj = 0; pj < partial.height; pj++) {
+                for (auto pi = 0; pi < partial.width; pi++) {
+                    auto i = partial.offset.x + pi, j = partial.offset.y + pj;
+                    auto& ns = reached[j * size.x + i];
+                    if (ns != partial.sample_start)
+                        ygl::log_fatal("partial {} leaves a gap or overlaps "
+                                       "the samples of pixel {}, {}",
+                            filenames[pid], i, j);
+                    ns = partial.tile_samples[(pj / partial.tile_size) *
+                                                  ntiles.x +
+                                              pi / partial.tile_size];
+                }
+            }
+        }
+        for (auto idx = 0; idx < reached.size(); idx++) {
+            if (!reached[idx])
+                ygl::log_fatal("partials do not cover pixel {}, {}",
+                    idx % size.x, idx / size.x);
+        }
+
+        // merge accumulations and resolve
+        auto buf = ygl::make_trace_buffer(ygl::image4f(size.x, size.y),
+            ygl::trace_params(), ygl::zero2i, size, 0, features, cost);
+        buf.params_hash = partials.front().params_hash;
+        for (auto& partial : partials) ygl::merge_trace_buffer(buf, partial);
+        auto img = ygl::image4f();
+        ygl::update_trace_image(img, buf);
+        if (denoise) {
+            auto albedo = ygl::image4f(), normal = ygl::image4f(),
+                 depth = ygl::image4f();
+            ygl::update_trace_features(albedo, normal, depth, buf);
+            img = ygl::denoise_trace_image(img, albedo, normal, depth);
+        }
+        if (!ygl::save_image(output, img, 0, 2.2f, false))
+            ygl::log_fatal("cannot save image {}", output);
+        if (!cofilename.empty()) {
+            auto cimg = ygl::image4f();
+            ygl::update_trace_cost(cimg, buf);
+            if (!ygl::save_image(cofilename, cimg, 0, 1, false))
+                ygl::log_fatal("cannot save image {}", cofilename);
+        }
     } else {
         // check parsing
         if (ygl::should_exit(parser)) {
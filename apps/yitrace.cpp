@@ -39,12 +39,13 @@ struct app_state {
     std::string imfilename;
     int resolution = 512;
     ygl::image4f img;
-    ygl::image<ygl::trace_pixel> pixels;
+    int img_version = 0;
     ygl::trace_lights lights;
     ygl::trace_params params;
-    std::vector<std::thread> async_threads;
-    bool async_stop = false;
+    ygl::trace_async_renderer* rnd = nullptr;
     bool scene_updated = false;
+    bool cache_updated = false;
+    bool lights_updated = false;
     bool navigation_fps = false;
     int preview_res = 64;
     bool rendering = false;
@@ -55,6 +56,7 @@ struct app_state {
     std::vector<ygl::scene_selection> update_list;
 
     ~app_state() {
+        if (rnd) delete rnd;
         if (scn) delete scn;
         if (view) delete view;
         if (bvh) delete bvh;
@@ -64,9 +66,6 @@ struct app_state {
 void draw(ygl::gl_window* win) {
     auto app = (app_state*)get_user_pointer(win);
 
-    // update texture
-    update_texture(app->trace_texture, app->img);
-
     // draw image
     auto window_size = get_window_size(win);
     auto framebuffer_size = get_framebuffer_size(win);
@@ -80,7 +79,8 @@ void draw(ygl::gl_window* win) {
             ygl::draw_label_widget(win, "scene", app->filename);
             ygl::draw_label_widget(
                 win, "size", "{} x {}", app->img.width(), app->img.height());
-            ygl::draw_label_widget(win, "sample", app->pixels.at(0, 0).sample);
+            ygl::draw_label_widget(
+                win, "sample", ygl::trace_async_nsamples(app->rnd));
             edited += ygl::draw_camera_selection_widget(
                 win, "camera", app->cam, app->scn, app->view);
             ygl::draw_value_widget(win, "fps", app->navigation_fps);
@@ -88,6 +88,7 @@ void draw(ygl::gl_window* win) {
         if (ygl::draw_header_widget(win, "params")) {
             if (ygl::draw_params_widgets(win, "", app->params)) {
                 app->scene_updated = true;
+                app->cache_updated = true;
             }
         }
         if (ygl::draw_header_widget(win, "image")) {
@@ -97,8 +98,11 @@ void draw(ygl::gl_window* win) {
         }
         if (ygl::draw_header_widget(win, "scene")) {
             if (ygl::draw_scene_widgets(
-                    win, "", app->scn, app->selection, app->update_list, {}))
+                    win, "", app->scn, app->selection, app->update_list, {})) {
                 app->scene_updated = true;
+                app->cache_updated = true;
+                app->lights_updated = true;
+            }
         }
     }
     ygl::end_widgets(win);
@@ -108,7 +112,7 @@ void draw(ygl::gl_window* win) {
 
 bool update(app_state* app) {
     if (app->scene_updated || !app->update_list.empty()) {
-        ygl::trace_async_stop(app->async_threads, app->async_stop);
+        ygl::trace_async_stop(app->rnd);
         app->rendering = false;
 
         // update BVH
@@ -123,6 +127,18 @@ bool update(app_state* app) {
         }
         app->update_list.clear();
 
+        // lights hold flattened materials, so rebuild them after edits
+        if (app->lights_updated) {
+            app->lights = ygl::make_trace_lights(app->scn);
+            app->lights_updated = false;
+        }
+
+        // the radiance cache is kept for camera edits only
+        if (app->cache_updated) {
+            ygl::clear_trace_async_cache(app->rnd);
+            app->cache_updated = false;
+        }
+
         // render preview
         auto pparams = app->params;
         pparams.nsamples = 1;
@@ -130,18 +146,24 @@ bool update(app_state* app) {
         auto pimg =
             ygl::image4f((int)std::round(app->cam->aspect * app->preview_res),
                 app->preview_res);
-        auto ppixels = make_trace_pixels(pimg, pparams);
+        auto pbuf = make_trace_buffer(pimg, pparams);
+        if (pparams.shader == ygl::trace_shader_type::pathtrace_cached)
+            ygl::share_trace_async_cache(app->rnd, pbuf, app->scn, pparams);
         ygl::trace_samples(app->scn, app->cam, app->bvh, app->lights, pimg,
-            ppixels, 1, pparams);
+            pbuf, 1, pparams);
         ygl::resize_image(pimg, app->img, ygl::resize_filter::box);
         ygl::update_texture(app->trace_texture, app->img);
 
         app->scene_updated = false;
     } else if (!app->rendering) {
-        ygl::trace_async_start(app->scn, app->cam, app->bvh, app->lights,
-            app->img, app->pixels, app->async_threads, app->async_stop,
-            app->params);
+        ygl::trace_async_start(
+            app->rnd, app->scn, app->cam, app->bvh, app->lights, app->params);
         app->rendering = true;
+    } else if (ygl::trace_async_nsamples(app->rnd) > 0) {
+        // keep the preview until the first pass covers the whole image
+        if (ygl::update_trace_async_image(
+                app->img, app->rnd, app->img_version))
+            ygl::update_texture(app->trace_texture, app->img);
     }
     return true;
 }
@@ -211,6 +233,7 @@ int main(int argc, char* argv[]) {
 
     // add elements
     auto opts = ygl::add_elements_options();
+    opts.texture_mipmaps = true;
     ygl::add_elements(app->scn, opts);
 
     // view camera
@@ -236,14 +259,13 @@ int main(int argc, char* argv[]) {
     app->img =
         ygl::image4f((int)round(app->cam->aspect * app->params.resolution),
             app->params.resolution);
-    app->pixels = ygl::make_trace_pixels(app->img, app->params);
+    app->rnd = ygl::make_trace_async_renderer();
     app->scene_updated = true;
 
     // run interactive
     run_ui(app);
 
     // cleanup
-    ygl::trace_async_stop(app->async_threads, app->async_stop);
     delete app;
 
     // done
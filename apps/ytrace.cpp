@@ -27,6 +27,14 @@
 //
 
 #include "../yocto/yocto_gl.h"
+#include "../yocto/ext/json.hpp"
+#include <deque>
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 using namespace std::literals;
 
 // Application state
@@ -38,7 +46,7 @@ struct app_state {
     std::string filename;
     std::string imfilename;
     ygl::image4f img;
-    ygl::image<ygl::trace_pixel> pixels;
+    ygl::trace_buffer buf;
     ygl::trace_params params;
     ygl::trace_lights lights;
     float exposure = 0, gamma = 2.2f;
@@ -46,45 +54,302 @@ struct app_state {
     ygl::vec4f background = {0, 0, 0, 0};
     bool save_batch = false;
     int batch_size = 16;
+    std::string ckfilename;
+    float checkpoint_interval = 300;
+    float time_budget = 0;
+    bool resume = false;
+    int frame_start = 0, frame_end = -1;
+    float frame_rate = 24;
+    bool all_cameras = false;
+    bool denoise = false;
+    float denoise_sigma = 2;
+    bool save_aovs = false;
+    ygl::vec4i tile = {0, 0, 0, 0};
+    ygl::vec2i sample_range = {0, 0};
+    int texture_cache_size = 0;
+    std::string stfilename;
+    std::string cofilename;
+    bool serve = false;
+    std::string socket;
+    ygl::texture_cache* txt_cache = nullptr;
 
+    // the state owns its scene, so it is not copied
+    app_state() {}
+    app_state(const app_state&) = delete;
+    app_state& operator=(const app_state&) = delete;
     ~app_state() {
         if (scn) delete scn;
         if (view) delete view;
         if (bvh) delete bvh;
+        if (txt_cache) delete txt_cache;
     }
 };
 
-int main(int argc, char* argv[]) {
-    // create empty scene
-    auto app = new app_state();
+// Filename for a given frame and camera. Frames are numbered only when
+// rendering an animation and cameras are named only when rendering many.
+std::string make_frame_filename(
+    const std::string& filename, const std::string& camname, int frame) {
+    if (filename.empty()) return filename;
+    auto prep = std::string();
+    if (!camname.empty()) prep += "." + camname;
+    if (frame >= 0) {
+        auto num = std::to_string(frame);
+        if (num.size() < 4) num = std::string(4 - num.size(), '0') + num;
+        prep += "." + num;
+    }
+    return ygl::prepend_path_extension(filename, prep);
+}
 
-    // parse command line
-    auto parser =
-        ygl::make_parser(argc, argv, "ytrace", "Offline oath tracing");
-    app->params = ygl::parse_params(parser, "", app->params);
-    app->batch_size = ygl::parse_opt(parser, "--batch-size", "",
-        "Compute images in <val> samples batches", 16);
-    app->save_batch = ygl::parse_flag(
-        parser, "--save-batch", "", "Save images progressively");
-    app->imfilename = ygl::parse_opt(
-        parser, "--output-image", "-o", "Image filename", "out.hdr"s);
-    app->filename = ygl::parse_arg(parser, "scene", "Scene filename", ""s);
-    if (ygl::should_exit(parser)) {
-        printf("%s\n", get_usage(parser).c_str());
-        exit(1);
+// Renders an image from a camera with the current scene state.
+bool render_image(app_state* app, const ygl::camera* cam,
+    const std::string& imfilename, const std::string& ckfilename,
+    const std::string& stfilename, const std::string& cofilename) {
+    // initialize rendering objects for the whole image or a partial render
+    // of a tile and sample range
+    auto width = (int)round(cam->aspect * app->params.resolution);
+    auto height = app->params.resolution;
+    auto partial = app->tile != ygl::zero4i || app->sample_range != ygl::zero2i;
+    auto tile = ygl::vec4i{0, 0, width, height};
+    if (app->tile != ygl::zero4i) {
+        tile.x = ygl::clamp(app->tile.x, 0, width);
+        tile.y = ygl::clamp(app->tile.y, 0, height);
+        tile.z = ygl::clamp(app->tile.z, 0, width - tile.x);
+        tile.w = ygl::clamp(app->tile.w, 0, height - tile.y);
+    }
+    auto sample_end = app->params.nsamples;
+    auto sample_start = ygl::clamp(app->sample_range.x, 0, sample_end);
+    if (app->sample_range.y > 0)
+        sample_end = ygl::clamp(app->sample_range.y, sample_start, sample_end);
+    if (!tile.z || !tile.w) {
+        ygl::log_error("empty tile");
+        return false;
     }
+    app->img = ygl::image4f(tile.z, tile.w);
+    app->buf = ygl::make_trace_buffer(app->img, app->params, {tile.x, tile.y},
+        {width, height}, sample_start, app->denoise || app->save_aovs,
+        !cofilename.empty());
 
-    // setting up rendering
+    // resume from checkpoint; frames not reached yet start from scratch
+    auto ckexists = false;
+    if (app->resume && !ckfilename.empty()) {
+        auto f = fopen(ckfilename.c_str(), "rb");
+        if (f) fclose(f);
+        ckexists = f != nullptr;
+        if (!ckexists && app->frame_end < app->frame_start) {
+            ygl::log_error("cannot load checkpoint {}", ckfilename);
+            return false;
+        }
+    }
+    if (ckexists) {
+        ygl::log_info("loading checkpoint {}", ckfilename);
+        try {
+            auto ckbuf = ygl::load_trace_buffer(ckfilename);
+            if (ckbuf.sample_start != sample_start ||
+                ckbuf.offset != ygl::vec2i{tile.x, tile.y})
+                throw std::runtime_error("checkpoint mismatch");
+            if (ckbuf.params_hash != app->buf.params_hash ||
+                ckbuf.albedo.empty() != app->buf.albedo.empty()) {
+                ygl::log_error(
+                    "checkpoint {} has different render params", ckfilename);
+                return false;
+            }
+            if (ckbuf.cost.empty() != app->buf.cost.empty()) {
+                ygl::log_error("checkpoint {} was saved {} --cost-image",
+                    ckfilename, (ckbuf.cost.empty()) ? "without" : "with");
+                return false;
+            }
+            app->buf = std::move(ckbuf);
+        } catch (std::exception& e) {
+            ygl::log_error("cannot load checkpoint {}", ckfilename);
+            return false;
+        }
+        if (app->buf.width != app->img.width() ||
+            app->buf.height != app->img.height()) {
+            ygl::log_error(
+                "checkpoint {} does not match image size", ckfilename);
+            return false;
+        }
+        ygl::update_trace_image(app->img, app->buf);
+    }
+
+    // checkpoints are written in the background while rendering continues
+    auto checkpoint = std::future<void>();
+    auto checkpoint_time = std::chrono::steady_clock::now();
+    auto save_checkpoint = [app, &ckfilename, &checkpoint]() {
+        if (checkpoint.valid()) checkpoint.get();
+        ygl::log_info("saving checkpoint {}", ckfilename);
+        checkpoint = std::async(
+            std::launch::async,
+            [filename = ckfilename, buf = ygl::copy_trace_buffer(app->buf)]() {
+                try {
+                    ygl::save_trace_buffer(filename, buf);
+                } catch (std::exception& e) {
+                    ygl::log_error("cannot save checkpoint {}", filename);
+                }
+            });
+    };
+
+    // render
+    ygl::log_info("starting renderer");
+    auto stats = ygl::trace_stats();
+    auto render_start = std::chrono::steady_clock::now();
+    for (auto cur_sample = app->buf.nsamples(); cur_sample < sample_end;
+         cur_sample += app->batch_size) {
+        auto now = std::chrono::steady_clock::now();
+        if (!ckfilename.empty() &&
+            std::chrono::duration<float>(now - checkpoint_time).count() >=
+                app->checkpoint_interval) {
+            save_checkpoint();
+            checkpoint_time = now;
+        }
+        if (app->save_batch && !partial && cur_sample) {
+            auto batchname =
+                ygl::format("{}{}.{}{}", ygl::path_dirname(imfilename),
+                    ygl::path_basename(imfilename), cur_sample,
+                    ygl::path_extension(imfilename));
+            ygl::log_info("saving image {}", batchname);
+            if (!save_image(batchname, app->img, app->exposure, app->gamma,
+                    app->filmic))
+                ygl::log_error("cannot save image {}", batchname);
+        }
+        ygl::log_info("rendering sample {}/{}", cur_sample, sample_end);
+        auto nsamples = ygl::min(app->batch_size, sample_end - cur_sample);
+        if (app->time_budget > 0) {
+            // the batch stops early when the time budget runs out
+            auto left = app->time_budget -
+                        std::chrono::duration<double>(
+                            std::chrono::steady_clock::now() - render_start)
+                            .count();
+            if (left <= 0 && cur_sample > sample_start) break;
+            if (ygl::trace_samples_budget(app->scn, cam, app->bvh,
+                    app->lights, app->img, app->buf, nsamples, left,
+                    app->params, &stats) < nsamples)
+                break;
+        } else {
+            trace_samples(app->scn, cam, app->bvh, app->lights, app->img,
+                app->buf, nsamples, app->params, &stats);
+        }
+    }
+    ygl::log_info("rendering done at sample {}", app->buf.nsamples());
+
+    // statistics
+    auto mrate = [&stats](uint64_t count) {
+        return (stats.time > 0) ? count / stats.time / 1e6 : 0.0;
+    };
+    ygl::log_info("rays {}M/s (camera {}M/s, bounce {}M/s, shadow {}M/s)",
+        mrate(stats.rays()), mrate(stats.camera_rays),
+        mrate(stats.bounce_rays), mrate(stats.shadow_rays));
+    ygl::log_info("bvh nodes {} prims {} per ray",
+        (stats.rays()) ? (double)stats.bvh_nodes / stats.rays() : 0.0,
+        (stats.rays()) ? (double)stats.bvh_prims / stats.rays() : 0.0);
+    ygl::log_info("russian roulette terminations {}", stats.rr_terminations);
+    if (!stfilename.empty()) {
+        ygl::log_info("saving stats {}", stfilename);
+        try {
+            ygl::save_trace_stats(stfilename, stats);
+        } catch (std::exception& e) {
+            ygl::log_error("cannot save stats {}", stfilename);
+        }
+    }
+
+    // save final checkpoint
+    if (!ckfilename.empty()) {
+        save_checkpoint();
+        checkpoint.get();
+    }
+
+    // partial renders save their raw accumulation to be merged later
+    if (partial) {
+        // partials are only merged, so the guiding distribution is dropped
+        app->buf.guiding = nullptr;
+        ygl::log_info("saving partial {}", imfilename);
+        try {
+            ygl::save_trace_buffer(imfilename, app->buf);
+        } catch (std::exception& e) {
+            ygl::log_error("cannot save partial {}", imfilename);
+            return false;
+        }
+        return true;
+    }
+
+    // cost heat map
+    if (!cofilename.empty()) {
+        auto cost = ygl::image4f();
+        ygl::update_trace_cost(cost, app->buf);
+        ygl::log_info("saving image {}", cofilename);
+        if (!ygl::save_image(cofilename, cost, 0, 1, false)) {
+            ygl::log_error("cannot save image {}", cofilename);
+            return false;
+        }
+    }
+
+    // denoise and save feature buffers
+    auto img = app->img;
+    if (app->denoise || app->save_aovs) {
+        auto albedo = ygl::image4f(), normal = ygl::image4f(),
+             depth = ygl::image4f();
+        ygl::update_trace_features(albedo, normal, depth, app->buf);
+        if (app->save_aovs) {
+            auto aovs = std::vector<std::pair<std::string, ygl::image4f*>>{
+                {"noisy", &app->img}, {"albedo", &albedo},
+                {"normal", &normal}, {"depth", &depth}};
+            for (auto& aov : aovs) {
+                auto aovname =
+                    ygl::prepend_path_extension(imfilename, "." + aov.first);
+                ygl::log_info("saving image {}", aovname);
+                if (!ygl::save_image(aovname, *aov.second, 0, 1, false)) {
+                    ygl::log_error("cannot save image {}", aovname);
+                    return false;
+                }
+            }
+        }
+        if (app->denoise) {
+            ygl::log_info("denoising image");
+            img = ygl::denoise_trace_image(
+                app->img, albedo, normal, depth, app->denoise_sigma);
+        }
+    }
+
+    // save image
+    ygl::log_info("saving image {}", imfilename);
+    if (!ygl::save_image(
+            imfilename, img, app->exposure, app->gamma, app->filmic)) {
+        ygl::log_error("cannot save image {}", imfilename);
+        return false;
+    }
+    return true;
+}
+
+// Loads the scene and prepares it for rendering.
+bool init_scene(app_state* app, bool preserve_hierarchy) {
     ygl::log_info("loading scene {}", app->filename);
     try {
-        app->scn = ygl::load_scene(app->filename);
+        auto lopts = ygl::load_options();
+        lopts.preserve_hierarchy = preserve_hierarchy;
+        lopts.load_textures = app->texture_cache_size <= 0;
+        app->scn = ygl::load_scene(app->filename, lopts);
     } catch (std::exception e) {
-        ygl::log_fatal("cannot load scene {}", app->filename);
-        return 1;
+        ygl::log_error("cannot load scene {}", app->filename);
+        return false;
+    }
+
+    // tiled textures, created next to the images on first use
+    if (app->texture_cache_size > 0) {
+        ygl::log_info("loading tiled textures");
+        app->txt_cache = ygl::make_texture_cache(
+            (size_t)app->texture_cache_size * 1024 * 1024);
+        try {
+            ygl::make_tiled_textures(
+                app->scn, app->txt_cache, ygl::path_dirname(app->filename));
+        } catch (const std::exception& e) {
+            ygl::log_error("cannot load textures for {}", app->filename);
+            return false;
+        }
     }
 
     // add elements
     auto opts = ygl::add_elements_options();
+    opts.texture_mipmaps = true;
     add_elements(app->scn, opts);
 
     // view camera
@@ -98,39 +363,458 @@ int main(int argc, char* argv[]) {
     // init renderer
     ygl::log_info("initializing tracer");
     app->lights = make_trace_lights(app->scn);
+    return true;
+}
+
+// Visitor that sets the reflected fields of an object from the keys of a
+// JSON object with the same names. Vectors and frames are flat arrays and
+// enums are strings. Visited names are collected to find unknown keys.
+struct json_visitor {
+    const nlohmann::json& js;
+    std::set<std::string>& names;
+
+    template <typename T,
+        typename std::enable_if_t<std::is_arithmetic<T>::value, int> = 0>
+    void operator()(T& val, const ygl::visit_var& var) {
+        names.insert(var.name);
+        if (js.count(var.name)) val = js.at(var.name).get<T>();
+    }
+    void operator()(std::string& val, const ygl::visit_var& var) {
+        names.insert(var.name);
+        if (js.count(var.name)) val = js.at(var.name).get<std::string>();
+    }
+    template <typename T,
+        typename std::enable_if_t<std::is_enum<T>::value, int> = 0>
+    void operator()(T& val, const ygl::visit_var& var) {
+        names.insert(var.name);
+        if (js.count(var.name))
+            val = ygl::get_value(
+                ygl::enum_names(val), js.at(var.name).get<std::string>());
+    }
+    template <typename T, int N>
+    void operator()(ygl::vec<T, N>& val, const ygl::visit_var& var) {
+        names.insert(var.name);
+        if (!js.count(var.name)) return;
+        for (auto i = 0; i < N; i++) val[i] = js.at(var.name).at(i).get<T>();
+    }
+    void operator()(ygl::frame3f& val, const ygl::visit_var& var) {
+        names.insert(var.name);
+        if (!js.count(var.name)) return;
+        for (auto i = 0; i < 12; i++)
+            (&val.x.x)[i] = js.at(var.name).at(i).get<float>();
+    }
+};
+
+// Sets the reflected fields of an object from a JSON object. Throws an
+// exception on unknown keys or wrong types.
+template <typename T>
+void update_from_json(T& val, const nlohmann::json& js,
+    const std::set<std::string>& extra = {}) {
+    if (!js.is_object()) throw std::runtime_error("object expected");
+    auto names = extra;
+    visit(val, json_visitor{js, names});
+    for (auto it = js.begin(); it != js.end(); ++it) {
+        if (!names.count(it.key()))
+            throw std::runtime_error("unknown key " + it.key());
+    }
+}
 
-    // initialize rendering objects
-    app->img =
-        ygl::image4f((int)round(app->cam->aspect * app->params.resolution),
-            app->params.resolution);
-    app->pixels = ygl::make_trace_pixels(app->img, app->params);
+// Render service. Jobs are lines of JSON read from stdin or from the clients
+// of a UNIX socket and rendered in order by the main thread. Scenes are
+// loaded on first use and kept, with their bvh and lights, for the
+// following jobs.
+struct service_client;
+struct service_job {
+    nlohmann::json js;
+    std::shared_ptr<service_client> client;
+};
+struct render_service {
+    app_state* defaults = nullptr;
+    std::map<std::string, app_state*> scenes;
+    std::deque<service_job> queue;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::mutex reply_mutex;
+    bool quit = false;
+
+    ~render_service() {
+        for (auto& kv : scenes) delete kv.second;
+    }
+};
+
+#ifndef _WIN32
+// Client connection. The socket is closed when the last job of the client
+// is done.
+struct service_client {
+    int fd = -1;
+    ~service_client() {
+        if (fd >= 0) close(fd);
+    }
+};
+#else
+struct service_client {};
+#endif
+
+// Sends a reply line to the client of a job, or to stdout.
+void send_reply(render_service* srv, const service_job& job,
+    const nlohmann::json& reply) {
+    auto line = reply.dump() + "\n";
+    std::lock_guard<std::mutex> lock(srv->reply_mutex);
+#ifndef _WIN32
+    if (job.client) {
+        send(job.client->fd, line.data(), line.size(), MSG_NOSIGNAL);
+        return;
+    }
+#endif
+    fputs(line.c_str(), stdout);
+    fflush(stdout);
+}
+
+// Parses a line of the protocol and queues its job. Returns false if the
+// service should stop reading.
+bool queue_job(render_service* srv, const std::string& line,
+    const std::shared_ptr<service_client>& client) {
+    if (line.find_first_not_of(" \t\r") == std::string::npos) return true;
+    auto job = service_job{nlohmann::json(), client};
+    try {
+        job.js = nlohmann::json::parse(line);
+        if (!job.js.is_object()) throw std::runtime_error("object expected");
+    } catch (std::exception& e) {
+        send_reply(srv, job,
+            {{"status", "error"}, {"error", "cannot parse job: "s + e.what()}});
+        return true;
+    }
+    auto id = job.js.value("id", nlohmann::json());
+    if (job.js.value("cmd", ""s) == "quit") {
+        std::lock_guard<std::mutex> lock(srv->mutex);
+        srv->quit = true;
+        srv->cond.notify_all();
+        return false;
+    }
+    auto position = 0;
+    {
+        std::lock_guard<std::mutex> lock(srv->mutex);
+        srv->queue.push_back(job);
+        position = (int)srv->queue.size();
+    }
+    srv->cond.notify_all();
+    send_reply(
+        srv, job, {{"id", id}, {"status", "queued"}, {"queue", position}});
+    return true;
+}
+
+// Creates the state of a service scene with the options parsed from the
+// command line. Only options are copied, scene data is loaded later.
+app_state* make_service_state(
+    const app_state* defaults, const std::string& filename) {
+    auto app = new app_state();
+    app->filename = filename;
+    app->params = defaults->params;
+    app->exposure = defaults->exposure;
+    app->gamma = defaults->gamma;
+    app->filmic = defaults->filmic;
+    app->background = defaults->background;
+    app->save_batch = defaults->save_batch;
+    app->batch_size = defaults->batch_size;
+    app->checkpoint_interval = defaults->checkpoint_interval;
+    app->time_budget = defaults->time_budget;
+    app->frame_start = defaults->frame_start;
+    app->frame_end = defaults->frame_end;
+    app->frame_rate = defaults->frame_rate;
+    app->denoise = defaults->denoise;
+    app->denoise_sigma = defaults->denoise_sigma;
+    app->save_aovs = defaults->save_aovs;
+    app->tile = defaults->tile;
+    app->sample_range = defaults->sample_range;
+    app->texture_cache_size = defaults->texture_cache_size;
+    return app;
+}
+
+// Runs a render job and returns its reply.
+nlohmann::json run_job(render_service* srv, const nlohmann::json& js) {
+    auto start = std::chrono::steady_clock::now();
+    auto filename = js.at("scene").get<std::string>();
+    auto imfilename = js.at("output").get<std::string>();
+
+    // scene, loaded on first use
+    if (!srv->scenes.count(filename)) {
+        auto app = make_service_state(srv->defaults, filename);
+        if (!init_scene(app, false)) {
+            delete app;
+            throw std::runtime_error("cannot load scene " + filename);
+        }
+        srv->scenes[filename] = app;
+    }
+    auto app = srv->scenes.at(filename);
+
+    // params and options
+    app->params = srv->defaults->params;
+    if (js.count("params")) update_from_json(app->params, js.at("params"));
+    app->time_budget = js.value("time_budget", srv->defaults->time_budget);
+
+    // camera, from a scene camera or the view camera, with overrides
+    auto cam = *app->view;
+    if (js.count("camera")) {
+        auto& jcam = js.at("camera");
+        auto name = jcam.value("name", ""s);
+        if (!name.empty()) {
+            auto found = false;
+            for (auto scam : app->scn->cameras) {
+                if (scam->name != name) continue;
+                cam = *scam;
+                found = true;
+            }
+            if (!found) throw std::runtime_error("unknown camera " + name);
+        }
+        update_from_json(cam, jcam, {"from", "to", "up"});
+        if (jcam.count("from") || jcam.count("to")) {
+            auto vec = [&jcam](const std::string& key, const ygl::vec3f& def) {
+                if (!jcam.count(key)) return def;
+                auto& jv = jcam.at(key);
+                return ygl::vec3f{jv.at(0).get<float>(), jv.at(1).get<float>(),
+                    jv.at(2).get<float>()};
+            };
+            auto from = vec("from", cam.frame.o);
+            auto to = vec("to", cam.frame.o - cam.frame.z * cam.focus);
+            cam.frame = ygl::lookat_frame(from, to, vec("up", {0, 1, 0}));
+            cam.focus = ygl::length(from - to);
+        }
+    }
 
     // render
-    ygl::log_info("starting renderer");
-    for (auto cur_sample = 0; cur_sample < app->params.nsamples;
-         cur_sample += app->batch_size) {
-        if (app->save_batch && cur_sample) {
-            auto imfilename =
-                ygl::format("{}{}.{}{}", ygl::path_dirname(app->imfilename),
-                    ygl::path_basename(app->imfilename), cur_sample,
-                    ygl::path_extension(app->imfilename));
-            ygl::log_info("saving image {}", imfilename);
-            save_image(
-                imfilename, app->img, app->exposure, app->gamma, app->filmic);
+    if (!render_image(app, &cam, imfilename, "", js.value("stats", ""s), ""))
+        throw std::runtime_error("cannot render " + imfilename);
+    return {{"status", "done"}, {"output", imfilename},
+        {"samples", app->buf.nsamples()},
+        {"time", std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()}};
+}
+
+// Runs the render service until stdin is closed or a quit command.
+int run_service(app_state* app) {
+    auto srv = std::make_shared<render_service>();
+    srv->defaults = app;
+    auto readers = std::vector<std::thread>();
+    if (app->serve) {
+        // replies go to stdout, so logs are kept out of it
+        ygl::get_default_logger()->_console = false;
+        readers.push_back(std::thread([srv]() {
+            auto line = std::string();
+            while (std::getline(std::cin, line)) {
+                if (!queue_job(srv.get(), line, nullptr)) return;
+            }
+            std::lock_guard<std::mutex> lock(srv->mutex);
+            srv->quit = true;
+            srv->cond.notify_all();
+        }));
+    }
+#ifndef _WIN32
+    auto sock = -1;
+    if (!app->socket.empty()) {
+        auto addr = sockaddr_un();
+        addr.sun_family = AF_UNIX;
+        if (app->socket.size() >= sizeof(addr.sun_path)) {
+            ygl::log_error("socket path too long {}", app->socket);
+            return 1;
         }
-        ygl::log_info(
-            "rendering sample {}/{}", cur_sample, app->params.nsamples);
-        trace_samples(app->scn, app->cam, app->bvh, app->lights, app->img,
-            app->pixels, app->batch_size, app->params);
+        strcpy(addr.sun_path, app->socket.c_str());
+        // remove a stale socket, but never a file given by mistake
+        struct stat info;
+        if (lstat(app->socket.c_str(), &info) == 0) {
+            if (!S_ISSOCK(info.st_mode)) {
+                ygl::log_error("{} exists and is not a socket", app->socket);
+                return 1;
+            }
+            unlink(app->socket.c_str());
+        }
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0 || bind(sock, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(sock, 16) < 0) {
+            ygl::log_error("cannot listen on socket {}", app->socket);
+            return 1;
+        }
+        ygl::log_info("listening on socket {}", app->socket);
+        readers.push_back(std::thread([srv, sock]() {
+            while (true) {
+                auto fd = accept(sock, nullptr, nullptr);
+                if (fd < 0) return;
+                auto client = std::make_shared<service_client>();
+                client->fd = fd;
+                std::thread([srv, client]() {
+                    auto buffer = std::string();
+                    char chunk[4096];
+                    while (true) {
+                        auto n = recv(client->fd, chunk, sizeof(chunk), 0);
+                        if (n <= 0) return;
+                        buffer.append(chunk, n);
+                        for (auto pos = buffer.find('\n');
+                             pos != std::string::npos;
+                             pos = buffer.find('\n')) {
+                            auto line = buffer.substr(0, pos);
+                            buffer.erase(0, pos + 1);
+                            if (!queue_job(srv.get(), line, client)) return;
+                        }
+                    }
+                }).detach();
+            }
+        }));
     }
-    ygl::log_info("rendering done");
+#else
+    if (!app->socket.empty()) {
+        ygl::log_error("sockets are not supported on this platform");
+        return 1;
+    }
+#endif
 
-    // save image
-    ygl::log_info("saving image {}", app->imfilename);
-    ygl::save_image(
-        app->imfilename, app->img, app->exposure, app->gamma, app->filmic);
+    // render jobs in order
+    while (true) {
+        auto job = service_job();
+        {
+            std::unique_lock<std::mutex> lock(srv->mutex);
+            srv->cond.wait(
+                lock, [&srv]() { return srv->quit || !srv->queue.empty(); });
+            if (srv->queue.empty()) break;
+            job = srv->queue.front();
+            srv->queue.pop_front();
+        }
+        auto reply = nlohmann::json();
+        try {
+            reply = run_job(srv.get(), job.js);
+        } catch (std::exception& e) {
+            reply = {{"status", "error"}, {"error", e.what()}};
+        }
+        reply["id"] = job.js.value("id", nlohmann::json());
+        send_reply(srv.get(), job, reply);
+    }
+
+    // cleanup
+#ifndef _WIN32
+    if (sock >= 0) {
+        shutdown(sock, SHUT_RDWR);
+        close(sock);
+        unlink(app->socket.c_str());
+    }
+#endif
+    for (auto& reader : readers) reader.detach();
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // create empty scene
+    auto app = new app_state();
+
+    // parse command line
+    auto parser =
+        ygl::make_parser(argc, argv, "ytrace", "Offline oath tracing");
+    app->params = ygl::parse_params(parser, "", app->params);
+    app->batch_size = ygl::parse_opt(parser, "--batch-size", "",
+        "Compute images in <val> samples batches", 16);
+    app->save_batch = ygl::parse_flag(
+        parser, "--save-batch", "", "Save images progressively");
+    app->ckfilename = ygl::parse_opt(
+        parser, "--checkpoint", "", "Checkpoint filename for render state", ""s);
+    app->checkpoint_interval = ygl::parse_opt(parser, "--checkpoint-interval",
+        "", "Seconds between checkpoints", 300.0f);
+    app->time_budget = ygl::parse_opt(parser, "--time-budget", "",
+        "Seconds to render each image for, up to the samples (0 for off)",
+        0.0f);
+    app->resume = ygl::parse_flag(
+        parser, "--resume", "", "Resume rendering from the checkpoint");
+    app->frame_start = ygl::parse_opt(
+        parser, "--frame-start", "", "First animation frame to render", 0);
+    app->frame_end = ygl::parse_opt(parser, "--frame-end", "",
+        "Last animation frame to render (-1 for no animation)", -1);
+    app->frame_rate = ygl::parse_opt(
+        parser, "--frame-rate", "", "Animation frames per second", 24.0f);
+    app->all_cameras = ygl::parse_flag(
+        parser, "--all-cameras", "", "Render all scene cameras");
+    app->denoise = ygl::parse_flag(
+        parser, "--denoise", "", "Denoise the image using feature buffers");
+    app->denoise_sigma = ygl::parse_opt(
+        parser, "--denoise-sigma", "", "Denoising filter width", 2.0f);
+    app->save_aovs = ygl::parse_flag(parser, "--save-aovs", "",
+        "Save noisy image, albedo, normal and depth buffers");
+    app->tile = ygl::parse_opt(parser, "--tile", "",
+        "Render only the tile \"x y width height\" to a partial file",
+        ygl::zero4i);
+    app->sample_range = ygl::parse_opt(parser, "--sample-range", "",
+        "Render only the samples \"start end\" to a partial file",
+        ygl::zero2i);
+    app->texture_cache_size = ygl::parse_opt(parser, "--texture-cache", "",
+        "Stream tiled textures from disk within this budget in MB (0 for off)",
+        0);
+    app->stfilename = ygl::parse_opt(parser, "--stats", "",
+        "Filename for ray and path statistics in JSON", ""s);
+    app->cofilename = ygl::parse_opt(parser, "--cost-image", "",
+        "Filename for a heat map of the render time per pixel", ""s);
+    app->serve = ygl::parse_flag(parser, "--serve", "",
+        "Run as a service rendering JSON jobs read from stdin");
+    app->socket = ygl::parse_opt(parser, "--socket", "",
+        "Run as a service rendering JSON jobs read from this UNIX socket",
+        ""s);
+    app->imfilename = ygl::parse_opt(
+        parser, "--output-image", "-o", "Image filename", "out.hdr"s);
+    app->filename = ygl::parse_arg(parser, "scene", "Scene filename", ""s,
+        !app->serve && app->socket.empty());
+    if (ygl::should_exit(parser)) {
+        printf("%s\n", get_usage(parser).c_str());
+        exit(1);
+    }
+
+    // setting up rendering
+    auto animate = app->frame_end >= app->frame_start;
+    if (app->serve || !app->socket.empty()) {
+        auto res = run_service(app);
+        delete app;
+        return res;
+    }
+    if (!init_scene(app, animate)) return 1;
+
+    // cameras to render; animated cameras are used directly
+    auto cams = std::vector<ygl::camera*>();
+    if (app->all_cameras && !app->scn->cameras.empty()) {
+        cams = app->scn->cameras;
+    } else if (animate && !app->scn->cameras.empty()) {
+        cams = {app->scn->cameras.at(0)};
+    } else {
+        cams = {app->cam};
+    }
+
+    // render frames, updating only what changes between them
+    auto ist_frames = std::vector<ygl::frame3f>();
+    for (auto ist : app->scn->instances) ist_frames.push_back(ist->frame);
+    for (auto frame = (animate) ? app->frame_start : -1;
+         frame <= ((animate) ? app->frame_end : -1); frame++) {
+        if (animate) {
+            ygl::log_info("updating frame {}", frame);
+            ygl::update_transforms(app->scn, frame / app->frame_rate);
+            auto moved = false;
+            for (auto iid = 0; iid < app->scn->instances.size(); iid++) {
+                auto& ist_frame = app->scn->instances[iid]->frame;
+                if (ist_frame == ist_frames[iid]) continue;
+                ist_frames[iid] = ist_frame;
+                moved = true;
+            }
+            if (moved) ygl::refit_bvh(app->bvh, app->scn, false);
+        }
+        for (auto cam : cams) {
+            auto camname = (cams.size() > 1) ? cam->name : ""s;
+            if (!render_image(app, cam,
+                    make_frame_filename(app->imfilename, camname, frame),
+                    make_frame_filename(app->ckfilename, camname, frame),
+                    make_frame_filename(app->stfilename, camname, frame),
+                    make_frame_filename(app->cofilename, camname, frame)))
+                return 1;
+        }
+    }
 
     // cleanup
+    if (app->txt_cache) {
+        auto stats = ygl::get_texture_cache_stats(app->txt_cache);
+        ygl::log_info(
+            "texture cache hits {} misses {}", stats.first, stats.second);
+    }
     delete app;
 
     // done
@@ -270,7 +270,8 @@
 /// 2. color conversion with `hsv_to_rgb()`, `xyz_to_rgb()` and `rgb_to_xyz()`
 /// 3. exposure-gamma tonemapping, with optional filmic curve, with
 ///    `tonemap_image()`
-/// 4. compositing support with `image_over()`
+/// 4. compositing support with `image_over()`, and denoising with
+///    `filter_bilateral()`
 /// 5. example image generation with `m,ake_grid_image()`,
 ///    `make_checker_image()`, `make_bumpdimple_image()`, `make_ramp_image()`,
 ///    `make_gammaramp_image()`, `make_gammaramp_imagef()`, `make_uv_image()`,
@@ -386,8 +387,9 @@
 /// 1. build the ray-tracing acceleration structure with `make_bvh()`
 /// 2. prepare lights for rendering `update_lights()`
 /// 3. define rendering params with the `trace_params` structure
-/// 4. initialize the progressive rendering buffers
+/// 4. create the progressive renderer with `make_trace_async_renderer()`
 /// 5. start the progressive renderer with `trace_async_start()`
+/// 6. read the image while rendering with `update_trace_async_image()`
 /// 7. stop the progressive renderer with `trace_async_stop()`
 ///
 ///
@@ -709,9 +711,11 @@ namespace ygl {}
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cmath>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -723,7 +727,10 @@ namespace ygl {}
 #include <initializer_list>
 #include <iostream>
 #include <limits>
+#include <list>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <set>
 #include <sstream>
@@ -3338,12 +3345,9 @@ inline float sample_index_pdf(int size) { return 1.0f / size; }
 
 /// Sample a discrete distribution represented by its cdf.
 inline int sample_discrete(const std::vector<float>& cdf, float r) {
-    // todo: implement binary search better
-    r = clamp(r * cdf.back(), 0.0f, cdf.back() - 0.00001f);
-    for (auto i = 1; i < cdf.size(); i++) {
-        if (cdf[i] > r) return i - 1;
-    }
-    return (int)cdf.size() - 1;
+    r = clamp(r * cdf.back(), 0.0f, cdf.back());
+    auto idx = std::upper_bound(cdf.begin(), cdf.end(), r) - cdf.begin();
+    return clamp((int)idx, 0, (int)cdf.size() - 1);
 }
 /// Pdf for uniform discrete distribution sampling.
 inline float sample_discrete_pdf(const std::vector<float>& cdf, int idx) {
@@ -3351,6 +3355,67 @@ inline float sample_discrete_pdf(const std::vector<float>& cdf, int idx) {
     return cdf.at(idx) - cdf.at(idx - 1);
 }
 
+/// Alias table for constant-time sampling of a discrete distribution.
+/// Built with Vose's method. Members are not part of the public API.
+struct alias_table {
+    /// Probability of keeping each bin.
+    std::vector<float> prob;
+    /// Alias of each bin.
+    std::vector<int> alias;
+    /// Normalized pdf of each element.
+    std::vector<float> pdf;
+    /// Check whether the table is empty.
+    bool empty() const { return pdf.empty(); }
+};
+
+/// Make an alias table from a set of non-negative weights. Falls back to a
+/// uniform distribution if all weights are zero.
+inline alias_table make_alias_table(const std::vector<float>& weights) {
+    auto tbl = alias_table();
+    auto n = (int)weights.size();
+    if (!n) return tbl;
+    auto sum = 0.0;
+    for (auto w : weights) sum += w;
+    tbl.pdf.resize(n);
+    for (auto i = 0; i < n; i++)
+        tbl.pdf[i] = (sum > 0) ? (float)(weights[i] / sum) : 1.0f / n;
+    tbl.prob.assign(n, 1);
+    tbl.alias.resize(n);
+    for (auto i = 0; i < n; i++) tbl.alias[i] = i;
+    auto scaled = std::vector<double>(n);
+    auto small = std::vector<int>(), large = std::vector<int>();
+    for (auto i = 0; i < n; i++) {
+        scaled[i] = tbl.pdf[i] * (double)n;
+        if (scaled[i] < 1)
+            small.push_back(i);
+        else
+            large.push_back(i);
+    }
+    while (!small.empty() && !large.empty()) {
+        auto s = small.back(), l = large.back();
+        small.pop_back();
+        tbl.prob[s] = (float)scaled[s];
+        tbl.alias[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1;
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    return tbl;
+}
+/// Sample an alias table.
+inline int sample_alias(const alias_table& tbl, float r) {
+    auto n = (int)tbl.prob.size();
+    auto x = clamp(r, 0.0f, 1 - flt_eps) * n;
+    auto idx = clamp((int)x, 0, n - 1);
+    return (x - idx < tbl.prob[idx]) ? idx : tbl.alias[idx];
+}
+/// Pdf for alias table sampling.
+inline float sample_alias_pdf(const alias_table& tbl, int idx) {
+    return tbl.pdf.at(idx);
+}
+
 /// @}
 
 }  // namespace ygl
@@ -4593,10 +4658,16 @@ namespace ygl {
 /// @defgroup image_ops Image operations
 /// @{
 
-/// Approximate conversion from srgb.
+/// Approximate conversion from srgb. Uses a table of the 256 byte values,
+/// since this is called for every texel of ldr texture lookups.
 inline vec4f srgb_to_linear(const vec4b& srgb) {
-    return {pow(byte_to_float(srgb.x), 2.2f), pow(byte_to_float(srgb.y), 2.2f),
-        pow(byte_to_float(srgb.z), 2.2f), byte_to_float(srgb.w)};
+    static const auto lut = []() {
+        auto lut = std::array<float, 256>();
+        for (auto i = 0; i < 256; i++)
+            lut[i] = pow(byte_to_float((byte)i), 2.2f);
+        return lut;
+    }();
+    return {lut[srgb.x], lut[srgb.y], lut[srgb.z], byte_to_float(srgb.w)};
 }
 /// Approximate conversion to srgb.
 inline vec4b linear_to_srgb(const vec4f& lin) {
@@ -4643,6 +4714,13 @@ void image_over(vec4f* img, int width, int height, int nlayers, vec4f** layers);
 /// Image over operator.
 void image_over(vec4b* img, int width, int height, int nlayers, vec4b** layers);
 
+/// Cross-bilateral filter. The range weights use the image colors and,
+/// optionally, the feature images with their sigmas. Disable the color range
+/// term with range_sigma <= 0. Rows are filtered in parallel.
+image4f filter_bilateral(const image4f& img, float spatial_sigma,
+    float range_sigma, const std::vector<image4f>& features = {},
+    const std::vector<float>& features_sigma = {}, bool parallel = true);
+
 /// Converts HSV to RGB.
 vec4b hsv_to_rgb(const vec4b& hsv);
 
@@ -5029,6 +5107,13 @@ void refit_bvh(bvh_tree* bvh, const std::vector<frame3f>& frames,
 /// shape barycentric coordinates `euv`.
 bool intersect_bvh(const bvh_tree* bvh, const ray3f& ray, bool find_any,
     float& ray_t, int& iid, int& sid, int& eid, vec2f& euv);
+/// Intersect ray with a bvh calling `hit_func(ray_t, iid, sid, eid, euv)`
+/// for all intersections along the ray, in no particular order, in a single
+/// traversal. Traversal stops as soon as `hit_func` returns false, in which
+/// case false is returned. Used to accumulate transmission along a segment.
+bool intersect_bvh(const bvh_tree* bvh, const ray3f& ray,
+    const std::function<bool(
+        float ray_t, int iid, int sid, int eid, const vec2f& euv)>& hit_func);
 
 /// Find a shape element that overlaps a point within a given distance
 /// `max_dist`, returning either the closest or any overlap depending on
@@ -5038,6 +5123,18 @@ bool intersect_bvh(const bvh_tree* bvh, const ray3f& ray, bool find_any,
 bool overlap_bvh(const bvh_tree* bvh, const vec3f& pos, float max_dist,
     bool find_any, float& dist, int& iid, int& sid, int& eid, vec2f& euv);
 
+/// Bvh traversal counters, accumulated per thread by ray intersection
+/// queries. Used to profile ray tracing.
+struct bvh_stats {
+    /// Number of nodes visited.
+    uint64_t nodes = 0;
+    /// Number of primitives tested.
+    uint64_t prims = 0;
+};
+
+/// Bvh traversal counters of the calling thread.
+bvh_stats& get_bvh_stats();
+
 /// Intersection point.
 struct intersection_point {
     /// Distance of the hit along the ray or from the point.
@@ -5099,6 +5196,9 @@ struct camera {
     float far = 10000;
 };
 
+// forward declaration
+struct tiled_texture;
+
 /// Texture containing either an LDR or HDR image.
 ///
 struct texture {
@@ -5110,6 +5210,15 @@ struct texture {
     image4b ldr = {};
     /// Hdr image.
     image4f hdr = {};
+    /// Ldr mipmap levels, excluding the full resolution image.
+    std::vector<image4b> ldr_mipmaps = {};
+    /// Hdr mipmap levels, excluding the full resolution image.
+    std::vector<image4f> hdr_mipmaps = {};
+    /// Out-of-core tiled storage used instead of the images if not null.
+    tiled_texture* tiled = nullptr;
+
+    /// Cleanup.
+    ~texture();
 };
 
 /// Texture information to use for lookup.
@@ -5424,6 +5533,111 @@ inline vec4f eval_texture(const texture* txt, const texture_info* info,
     return eval_texture(
         txt, (info) ? *info : texture_info(), texcoord, srgb, def);
 }
+/// Builds the mipmap levels of a texture with a box filter. Ldr colors are
+/// averaged in linear space if `srgb` is true, and as stored otherwise, as
+/// for normal maps.
+void update_texture_mipmaps(texture* txt, bool srgb = true);
+/// Evaluate a texture with trilinear filtering over mipmap levels, for a
+/// lookup whose `footprint` is given as a width in texture coordinates.
+/// Falls back to eval_texture() if mipmaps are missing or disabled.
+vec4f eval_texture_mipmap(const texture* txt, const texture_info& info,
+    const vec2f& texcoord, float footprint, bool srgb = true,
+    const vec4f& def = {1, 1, 1, 1});
+/// Evaluate a texture with trilinear filtering over mipmap levels.
+inline vec4f eval_texture_mipmap(const texture* txt, const texture_info* info,
+    const vec2f& texcoord, float footprint, bool srgb = true,
+    const vec4f& def = {1, 1, 1, 1}) {
+    return eval_texture_mipmap(txt, (info) ? *info : texture_info(), texcoord,
+        footprint, srgb, def);
+}
+/// Angle subtended by a pixel of a camera at resolution `res`. Used as the
+/// spread of camera ray cones.
+float eval_camera_spread(const camera* cam, int res);
+
+/// LRU cache of texture tiles with a memory budget, shared by tiled
+/// textures. Tiles are paged in from disk on demand during lookups. The cache
+/// is split in shards, each with its own lock, to keep contention low when
+/// many threads perform lookups. The members are not part of the public API.
+struct texture_cache {
+    /// Tile data.
+    using tile = std::shared_ptr<const std::vector<byte>>;
+    /// Cache shard.
+    struct shard {
+        /// Lock for the shard.
+        std::mutex mutex;
+        /// Tile keys from the most to the least recently used.
+        std::list<uint64_t> lru;
+        /// Tiles and their position in the lru list.
+        std::unordered_map<uint64_t,
+            std::pair<tile, std::list<uint64_t>::iterator>>
+            tiles;
+        /// Bytes used by the tiles.
+        size_t bytes = 0;
+        /// Number of tile lookups found in the shard.
+        uint64_t hits = 0;
+        /// Number of tile lookups read from disk.
+        uint64_t misses = 0;
+    };
+    /// Maximum bytes used by tiles.
+    size_t max_bytes = 0;
+    /// Shards.
+    std::array<shard, 32> shards;
+    /// Next texture id.
+    std::atomic<int> next_id{0};
+};
+
+/// Texture stored on disk as square tiles for each mipmap level, and paged
+/// into a texture cache on lookup. The members are not part of the public
+/// API.
+struct tiled_texture {
+    /// Tiled file name.
+    std::string filename = "";
+    /// Whether texels are stored as hdr.
+    bool hdr = false;
+    /// Tile size in texels.
+    int tile_size = 64;
+    /// Size of mipmap levels, starting from the full resolution.
+    std::vector<vec2i> levels = {};
+    /// File offset of the first tile of each level.
+    std::vector<uint64_t> offsets = {};
+    /// Cache for the tiles.
+    texture_cache* cache = nullptr;
+    /// Id of the texture in the cache.
+    int id = 0;
+    /// Open file.
+    FILE* file = nullptr;
+    /// Lock for file reads.
+    mutable std::mutex file_mutex;
+
+    /// Cleanup.
+    ~tiled_texture();
+};
+
+/// Initialize a texture cache that keeps at most `max_bytes` of tiles.
+texture_cache* make_texture_cache(size_t max_bytes);
+/// Number of tile lookups found in the cache and read from disk. Lookups
+/// are counted per shard, so this sums over the shards.
+std::pair<uint64_t, uint64_t> get_texture_cache_stats(texture_cache* cache);
+/// Saves a texture as a tiled file, with mipmap levels, for out-of-core
+/// rendering. Mipmap levels are built as in update_texture_mipmaps() if the
+/// texture has none. Throws an exception on error.
+void save_tiled_texture(const std::string& filename, const texture* txt,
+    int tile_size = 64, bool srgb = true);
+/// Opens a tiled texture whose tiles are paged into `cache`. Throws an
+/// exception on error.
+tiled_texture* load_tiled_texture(
+    const std::string& filename, texture_cache* cache);
+/// Switches scene textures to out-of-core tiled storage paged into `cache`,
+/// releasing their images. Tiled files are stored next to the texture
+/// images, at the image path with the extension `.ytx` appended, and are
+/// created from the images the first time or when the images are newer.
+/// Files are written to a temporary file and renamed, so that interrupted
+/// or concurrent processes never leave a truncated file. Textures are
+/// decoded one at a time, so scenes loaded without textures never hold all
+/// images in memory.
+/// The scene textures are relative to `dirname`.
+void make_tiled_textures(
+    scene* scn, texture_cache* cache, const std::string& dirname);
 /// Generates a ray from a camera for image plane coordinate `uv` and the
 /// lens coordinates `luv`.
 ray3f eval_camera_ray(const camera* cam, const vec2f& uv, const vec2f& luv);
@@ -5519,6 +5733,9 @@ struct add_elements_options {
     bool default_names = true;
     /// Add default paths.
     bool default_paths = true;
+    /// Add texture mipmaps. Off by default, since they take a third more
+    /// texture memory and only renderers filter textures.
+    bool texture_mipmaps = false;
 
     /// Initialize to no elements.
     static add_elements_options none() {
@@ -5638,6 +5855,14 @@ inline void visit(texture& val, Visitor&& visitor) {
         visit_var{"ldr", visit_var_type::value, "Ldr image.", 0, 0, ""});
     visitor(val.hdr,
         visit_var{"hdr", visit_var_type::value, "Hdr image.", 0, 0, ""});
+    visitor(val.ldr_mipmaps,
+        visit_var{"ldr_mipmaps", visit_var_type::value,
+            "Ldr mipmap levels, excluding the full resolution image.", 0, 0,
+            ""});
+    visitor(val.hdr_mipmaps,
+        visit_var{"hdr_mipmaps", visit_var_type::value,
+            "Hdr mipmap levels, excluding the full resolution image.", 0, 0,
+            ""});
 }
 
 /// Visit struct elements.
@@ -6602,6 +6827,11 @@ enum struct trace_shader_type {
     debug_albedo,
     /// Debug texcoord.
     debug_texcoord,
+    /// Pathtrace with path guiding learned over sample batches.
+    pathtrace_guided,
+    /// Pathtrace ending paths at their second hit with a radiance cache
+    /// filled over the samples, for previews.
+    pathtrace_cached,
 };
 
 /// Random number generator type.
@@ -6610,6 +6840,10 @@ enum struct trace_rng_type {
     uniform = 0,
     /// Stratified random numbers.
     stratified,
+    /// Owen-scrambled Sobol sequence, padded in two dimensions.
+    sobol,
+    /// Owen-scrambled Halton sequence.
+    halton,
 };
 
 /// Filter type.
@@ -6656,28 +6890,186 @@ struct trace_params {
     bool parallel = true;
     /// Seed for the random number generators. @refl_uilimits(0,1000)
     uint32_t seed = 0;
+    /// Fraction of bounces sampled from the path guiding distribution.
+    /// @refl_uilimits(0,1)
+    float guiding_fraction = 0.5f;
+    /// Memory cap of the path guiding distribution in MB.
+    /// @refl_uilimits(1,4096)
+    int guiding_memory = 64;
+    /// Number of candidate light samples resampled for direct lighting.
+    /// @refl_uilimits(1,64)
+    int light_candidates = 1;
+    /// Number of light samples at the first hit. @refl_uilimits(1,16)
+    int light_samples = 1;
+    /// Number of light samples at later hits. @refl_uilimits(1,16)
+    int indirect_light_samples = 1;
+    /// Number of radiance cache cells along the scene diagonal.
+    /// @refl_uilimits(16,1024)
+    int cache_resolution = 64;
 };
 
 // #codegen end refl-trace
 
-/// Trace pixel state. Handles image accumulation and random number generation
-/// for uniform and stratified sequences. The members are not part of the
-/// the public API.
+/// Trace statistics. Counts the work done by the tracer, to measure the cost
+/// of a scene. Counters are kept per thread and merged by trace_samples().
+struct trace_stats {
+    /// Number of samples computed.
+    uint64_t samples = 0;
+    /// Number of camera rays.
+    uint64_t camera_rays = 0;
+    /// Number of path extension rays.
+    uint64_t bounce_rays = 0;
+    /// Number of shadow rays.
+    uint64_t shadow_rays = 0;
+    /// Number of bvh nodes visited.
+    uint64_t bvh_nodes = 0;
+    /// Number of bvh primitives tested.
+    uint64_t bvh_prims = 0;
+    /// Number of paths terminated by russian roulette.
+    uint64_t rr_terminations = 0;
+    /// Histogram of path lengths, in number of shaded surfaces.
+    std::vector<uint64_t> path_lengths;
+    /// Rendering time in seconds.
+    double time = 0;
+
+    /// Total number of rays.
+    uint64_t rays() const { return camera_rays + bounce_rays + shadow_rays; }
+};
+
+/// Path guiding distribution, learned by trace_samples() for guided path
+/// tracing. The members are not part of the public API.
+struct trace_guiding;
+
+/// Radiance cache of cached path tracing, filled by the path vertices and
+/// looked up to end paths early. The members are not part of the public API.
+struct trace_cache;
+
+/// Trace pixel sample state. Handles random number generation for the
+/// sample of a pixel. It is created for each sample from the pixel
+/// coordinates and sample number, so it is never stored. The members are not
+/// part of the the public API.
 struct trace_pixel {
-    /// Accumulated radiance.
-    vec3f col = zero3f;
-    /// Accumulated coverage.
-    float alpha = 1;
     /// Random number state.
     rng_pcg32 rng = rng_pcg32();
-    /// Pixel coordinates.
+    /// Pixel coordinates in the full image.
     int i = 0, j = 0;
-    /// Number of samples computed.
+    /// Sample number, starting from 1.
     int sample = 0;
     /// Current dimension.
     int dimension = 0;
-    /// Pixel weight for filtering.
-    float weight = 0;
+    /// Statistics of the current thread, if computed.
+    trace_stats* stats = nullptr;
+    /// Path guiding distribution, if used.
+    trace_guiding* guiding = nullptr;
+    /// Radiance cache, if used.
+    trace_cache* cache = nullptr;
+};
+
+/// Trace buffer. Accumulates samples for an image, or a tile of it, in a
+/// structure-of-arrays layout indexed by `j * width + i`. Pixel coordinates
+/// are derived from the index and random numbers from the sample number, so
+/// that only the accumulated values are stored. Samples are computed for
+/// square tiles at a time, and counted per tile. The members are not part of
+/// the the public API.
+struct trace_buffer {
+    /// Buffer width.
+    int width = 0;
+    /// Buffer height.
+    int height = 0;
+    /// Position of the buffer in the full image.
+    vec2i offset = zero2i;
+    /// Full image width, used to seed the random numbers.
+    int image_width = 0;
+    /// Full image height, used to check that merged buffers cover it.
+    int image_height = 0;
+    /// First sample computed by this buffer.
+    int sample_start = 0;
+    /// Size of the tiles used for sample counts.
+    int tile_size = 16;
+    /// Hash of the render params that change the samples, used to reject
+    /// checkpoints and partials rendered with different params.
+    uint64_t params_hash = 0;
+    /// Number of samples computed for each tile, starting at `sample_start`.
+    std::vector<int> tile_samples;
+    /// Accumulated radiance and coverage.
+    std::vector<vec4f> col;
+    /// Accumulated filter weight. Might be negative for filters with
+    /// negative lobes.
+    std::vector<float> weight;
+    /// Accumulated first-hit albedo, used as denoising feature. Empty if
+    /// features are not computed.
+    std::vector<vec3f> albedo;
+    /// Accumulated first-hit normal, used as denoising feature.
+    std::vector<vec3f> norm;
+    /// Accumulated first-hit distance, used as denoising feature.
+    std::vector<float> depth;
+    /// Accumulated render time in seconds, used to find expensive pixels.
+    /// Empty if cost is not computed.
+    std::vector<float> cost;
+    /// Number of samples computed for each pixel, used to average features
+    /// and cost, since merged tiles may not match the tiles of the partial
+    /// renders. Empty if neither is computed.
+    std::vector<int> samples;
+    /// Path guiding distribution, learned over the sample batches of guided
+    /// path tracing. It is saved with the buffer, so that resumed renders
+    /// keep learning it. Tiles and sample ranges rendered by independent
+    /// processes each learn their own.
+    std::shared_ptr<trace_guiding> guiding;
+    /// Radiance cache of cached path tracing, filled over the sample batches.
+    /// It is not saved with the buffer.
+    std::shared_ptr<trace_cache> cache;
+    /// Render time per sample of the last pass of trace_samples_budget(),
+    /// used to size the passes of later calls. It is not saved.
+    double sample_time = 0;
+
+    /// Check whether the buffer is empty.
+    bool empty() const { return col.empty(); }
+    /// Number of tiles in each dimension.
+    vec2i ntiles() const {
+        return {(width + tile_size - 1) / tile_size,
+            (height + tile_size - 1) / tile_size};
+    }
+    /// Number of samples computed for all tiles.
+    int nsamples() const {
+        auto ns = (tile_samples.empty()) ? sample_start : tile_samples[0];
+        for (auto s : tile_samples) ns = min(ns, s);
+        return ns;
+    }
+};
+
+/// Compact material record of a shape, flattened from its material for
+/// rendering. Parameters are converted to specular-roughness whenever
+/// textures and vertex colors allow it, so that only textured conversions
+/// are done per hit. Records are kept to 64 bytes, so that the records of a
+/// group are packed densely. The members are not part of the public API.
+struct trace_material {
+    /// Emission color.
+    vec3f ke = zero3f;
+    /// Diffuse color, or base color for unconverted metallic-roughness.
+    vec3f kd = zero3f;
+    /// Specular color, or metallic factor for unconverted metallic-roughness.
+    vec3f ks = zero3f;
+    /// Transmission color.
+    vec3f kt = zero3f;
+    /// Roughness, or glossiness for unconverted specular-glossiness.
+    float rs = 0;
+    /// Material type, specular_roughness once converted.
+    material_type type = material_type::specular_roughness;
+    /// Index of the first active texture in the texture table.
+    int txt_start = 0;
+    /// Bitmask of the active textures, in the order ke, kd, ks, kt, norm, occ.
+    uint16_t txt_mask = 0;
+    /// Double-sided rendering.
+    bool double_sided = false;
+};
+static_assert(sizeof(trace_material) == 64, "trace_material size");
+
+/// Texture table entry of the compact material records.
+struct trace_texture {
+    /// Texture.
+    const texture* txt = nullptr;
+    /// Texture info.
+    texture_info info = {};
 };
 
 /// Trace light as either instances or environments. The members are not part of
@@ -6685,59 +7077,228 @@ struct trace_pixel {
 struct trace_light {
     /// Instance pointer for instance lights.
     const instance* ist = nullptr;
+    /// Material record of the instance shape for instance lights.
+    int mid = -1;
     /// Environment pointer for environment lights.
     const environment* env = nullptr;
-};
-
-/// Trace lights. Handles sampling of illumination. The members are not part of
-/// the the public API.
+    /// Emitted power used for light selection.
+    float power = 0;
+    /// First entry of each shape of the group in the element distribution,
+    /// for instance lights. Shapes that do not emit have no entries.
+    std::vector<int> elem_start;
+    /// Cumulative emitted power of the elements of the group, in world
+    /// space, for instance lights.
+    std::vector<float> elem_cdf;
+};
+
+/// Trace lights. Handles sampling of illumination. Lights are picked
+/// proportionally to their emitted power, and so are the elements of
+/// instance lights. The members are not part of the the public API.
 struct trace_lights {
     /// Shape instances.
     std::vector<trace_light> lights;
-    /// Shape cdfs.
-    std::unordered_map<const shape*, std::vector<float>> shape_cdfs;
-    /// Shape areas.
-    std::unordered_map<const shape*, float> shape_areas;
+    /// Light selection table.
+    alias_table light_table;
+    /// Light index for instance lights.
+    std::unordered_map<const instance*, int> instance_lights;
+    /// Light index for environment lights.
+    std::unordered_map<const environment*, int> environment_lights;
+    /// Compact material records of all shapes, grouped by shape group.
+    std::vector<trace_material> materials;
+    /// Texture table of the material records.
+    std::vector<trace_texture> textures;
+    /// First material record of each instance, indexed by instance id, so
+    /// that the record of a hit is at `instance_materials[iid] + sid`.
+    std::vector<int> instance_materials;
     /// Check whether there are any lights.
     bool empty() const { return lights.empty(); }
     /// Number of lights.
     int size() const { return (int)lights.size(); }
 };
 
-/// Initialize trace pixels.
-image<trace_pixel> make_trace_pixels(
-    const image4f& img, const trace_params& params);
-/// Initialize trace lights.
+/// Initialize a trace buffer for the image. Feature buffers for denoising
+/// are allocated only if `features` is true, and the per-pixel render cost
+/// only if `cost` is true.
+trace_buffer make_trace_buffer(const image4f& img, const trace_params& params,
+    bool features = false, bool cost = false);
+/// Initialize a trace buffer for a tile of an image of size `size`, placed
+/// at pixel `offset`, that computes samples from `sample_start` on. Random
+/// sequences depend only on the pixel and sample number, so that tiles and
+/// disjoint sample ranges can be rendered by independent processes and
+/// merged with merge_trace_buffer().
+trace_buffer make_trace_buffer(const image4f& img, const trace_params& params,
+    const vec2i& offset, const vec2i& size, int sample_start,
+    bool features = false, bool cost = false);
+/// Adds the raw accumulation of a partial trace buffer, rendered for a tile
+/// or a sample range, to the buffer of the full image. Sample counts are
+/// summed so that the merged pixels resolve as if rendered at once. Tile
+/// sample counts are taken from the partial covering the first pixel of
+/// each tile, so merged buffers should not be rendered further.
+void merge_trace_buffer(trace_buffer& buf, const trace_buffer& partial);
+/// Updates the image from the trace buffer.
+void update_trace_image(image4f& img, const trace_buffer& buf);
+/// Updates the first-hit albedo, normal and depth feature buffers from the
+/// trace buffer. Features are averaged over the pixel samples.
+void update_trace_features(image4f& albedo, image4f& normal, image4f& depth,
+    const trace_buffer& buf);
+/// Updates a false color heat map of the render time per sample of each
+/// pixel, from black for the cheapest to white for the most expensive.
+/// Colors are normalized to the 99th percentile of the cost, so that a few
+/// outliers do not hide the rest of the image.
+void update_trace_cost(image4f& img, const trace_buffer& buf);
+/// Denoises a traced image with a multithreaded cross-bilateral filter
+/// guided by the feature buffers. Lighting is filtered with albedo divided
+/// out, so that texture detail is preserved, and its range term is computed
+/// on tonemapped values. Depth is compared relative to the largest depth in
+/// the image.
+image4f denoise_trace_image(const image4f& img, const image4f& albedo,
+    const image4f& normal, const image4f& depth, float spatial_sigma = 2,
+    float range_sigma = 0.1f, float albedo_sigma = 0.1f,
+    float normal_sigma = 0.3f, float depth_sigma = 0.02f);
+
+/// Copies a trace buffer, with its own copy of the path guiding
+/// distribution, so that it can be saved while rendering continues.
+trace_buffer copy_trace_buffer(const trace_buffer& buf);
+/// Saves the trace buffer accumulation state in a compact binary checkpoint.
+/// The file is written to a temporary file first and then renamed, so that
+/// an interrupted save never corrupts a previous checkpoint. Tiles store
+/// their offset and partial renders their first sample, so the same file is
+/// used to merge distributed renders. A hash of the render params is stored
+/// with the state, to detect files rendered with different params. Throws
+/// an exception on error.
+void save_trace_buffer(const std::string& filename, const trace_buffer& buf);
+/// Loads a trace buffer saved by save_trace_buffer(). Rendering can continue
+/// from the loaded state exactly as if it was never interrupted. Throws an
+/// exception on error.
+trace_buffer load_trace_buffer(const std::string& filename);
+/// Initialize trace lights. Also flattens the scene materials, so lights
+/// need to be initialized again after material edits.
 trace_lights make_trace_lights(const scene* scn);
 
-/// Trace the next `nsamples` samples.
+/// Trace the next `nsamples` samples. Pixel filters are handled by
+/// importance sampling the filter when generating camera rays, so that each
+/// sample contributes only to its own pixel with a signed weight. If `stats`
+/// is not null, the statistics of the samples are added to it.
 void trace_samples(const scene* scn, const camera* cam, const bvh_tree* bvh,
-    const trace_lights& lights, image4f& img, image<trace_pixel>& pixels,
-    int nsamples, const trace_params& params);
-
-/// Trace the next `nsamples` samples with image filtering.
-void trace_samples_filtered(const scene* scn, const camera* cam,
+    const trace_lights& lights, image4f& img, trace_buffer& buf, int nsamples,
+    const trace_params& params, trace_stats* stats = nullptr);
+
+/// Trace up to `nsamples` samples within a time budget of `seconds`. Samples
+/// are traced in passes sized from the cost per sample of the previous pass,
+/// also across calls on the same buffer, so that the last pass ends before
+/// the deadline instead of being cut. At least one sample is traced. Returns
+/// the number of samples computed.
+int trace_samples_budget(const scene* scn, const camera* cam,
     const bvh_tree* bvh, const trace_lights& lights, image4f& img,
-    image<trace_pixel>& pixels, int nsamples, const trace_params& params);
+    trace_buffer& buf, int nsamples, double seconds,
+    const trace_params& params, trace_stats* stats = nullptr);
+
+/// Adds trace statistics to others.
+void merge_trace_stats(trace_stats& stats, const trace_stats& other);
+/// Saves trace statistics in JSON, with rates per second and the path length
+/// histogram. Throws an exception on error.
+void save_trace_stats(const std::string& filename, const trace_stats& stats);
 
 /// Trace the whole image.
 inline image4f trace_image(const scene* scn, const camera* cam,
     const bvh_tree* bvh, const trace_params& params) {
     auto img = image4f(
         (int)std::round(cam->aspect * params.resolution), params.resolution);
-    auto pixels = make_trace_pixels(img, params);
+    auto buf = make_trace_buffer(img, params);
     auto lights = make_trace_lights(scn);
-    trace_samples(scn, cam, bvh, lights, img, pixels, params.nsamples, params);
+    trace_samples(scn, cam, bvh, lights, img, buf, params.nsamples, params);
     return img;
 }
 
-/// Starts an anyncrhounous renderer.
-void trace_async_start(const scene* scn, const camera* cam, const bvh_tree* bvh,
-    const trace_lights& lights, image4f& img, image<trace_pixel>& pixels,
-    std::vector<std::thread>& threads, bool& stop_flag,
-    const trace_params& params);
-/// Stop the asynchronous renderer.
-void trace_async_stop(std::vector<std::thread>& threads, bool& stop_flag);
+/// Asynchronous progressive renderer. Renders one sample per pixel per pass
+/// with a pool of worker threads that is kept across restarts, so that
+/// restarting after a camera or scene edit only cancels the tiles in flight.
+/// Tiles are rendered under a claim lock and copied to the image under a
+/// separate tile lock, so update_trace_async_image() never waits for a
+/// tile render. The members are not part of the public API.
+struct trace_async_renderer {
+    /// Scene being rendered.
+    const scene* scn = nullptr;
+    /// Camera being rendered.
+    const camera* cam = nullptr;
+    /// Acceleration structure being rendered.
+    const bvh_tree* bvh = nullptr;
+    /// Lights being rendered.
+    const trace_lights* lights = nullptr;
+    /// Rendering params.
+    trace_params params;
+    /// Callback called by a worker after each completed pass, with the
+    /// number of samples computed for all pixels.
+    std::function<void(int)> progress;
+    /// Trace buffer.
+    trace_buffer buf;
+    /// Radiance cache of cached path tracing, kept across jobs until cleared.
+    std::shared_ptr<trace_cache> cache;
+    /// Rendered image.
+    image4f img;
+    /// Tile locks, held while a tile of the image is written or read.
+    std::vector<std::mutex> tile_locks;
+    /// Tile claims, held while a tile of the buffer is rendered.
+    std::vector<std::mutex> tile_claims;
+    /// Number of tiles that completed each pass.
+    std::unique_ptr<std::atomic<int>[]> pass_tiles;
+    /// Next work item, as pass times the number of tiles plus tile.
+    std::atomic<int> next_item{0};
+    /// Number of work items.
+    int nitems = 0;
+    /// Image version, incremented for each rendered tile.
+    std::atomic<int> version{0};
+    /// Number of passes completed by all tiles.
+    std::atomic<int> nsamples{0};
+    /// Cancel flag of the current job.
+    std::atomic<bool> cancel{false};
+    /// Worker threads.
+    std::vector<std::thread> threads;
+    /// Lock for job state and worker synchronization.
+    std::mutex mutex;
+    /// Signals the workers that a job started or the renderer quits.
+    std::condition_variable job_cond;
+    /// Signals that no worker is busy.
+    std::condition_variable idle_cond;
+    /// Job number, incremented at each start.
+    int job = 0;
+    /// Number of workers busy on the current job.
+    int busy = 0;
+    /// Whether the workers should exit.
+    bool quit = false;
+
+    /// Cleanup, stopping and joining the workers.
+    ~trace_async_renderer();
+};
+
+/// Creates an asynchronous renderer. Worker threads are started on the
+/// first call to trace_async_start().
+trace_async_renderer* make_trace_async_renderer();
+/// Starts the asynchronous renderer, cancelling any render in progress and
+/// resetting the image. The image has the camera aspect and the params
+/// resolution. `progress` is called from a worker thread after each pass.
+void trace_async_start(trace_async_renderer* rnd, const scene* scn,
+    const camera* cam, const bvh_tree* bvh, const trace_lights& lights,
+    const trace_params& params,
+    const std::function<void(int)>& progress = {});
+/// Stops the asynchronous renderer. Cancels the tiles not started yet and
+/// waits for the ones in flight.
+void trace_async_stop(trace_async_renderer* rnd);
+/// Copies the image of the asynchronous renderer if it changed since
+/// `version`, and updates `version`. Returns whether the image was copied.
+bool update_trace_async_image(
+    image4f& img, trace_async_renderer* rnd, int& version);
+/// Number of samples computed for all pixels by the asynchronous renderer.
+int trace_async_nsamples(const trace_async_renderer* rnd);
+/// Shares the radiance cache of the asynchronous renderer with a buffer, so
+/// that previews rendered with trace_samples() use and fill it. The cache is
+/// created if needed.
+void share_trace_async_cache(trace_async_renderer* rnd, trace_buffer& buf,
+    const scene* scn, const trace_params& params);
+/// Clears the radiance cache of the asynchronous renderer. The cache is kept
+/// across restarts, so it has to be cleared after editing the scene or the
+/// params, but not after moving the camera.
+void clear_trace_async_cache(trace_async_renderer* rnd);
 
 // #codegen begin reflgen-trace
 
@@ -6753,6 +7314,8 @@ enum_names<trace_shader_type>() {
         {"debug_normal", trace_shader_type::debug_normal},
         {"debug_albedo", trace_shader_type::debug_albedo},
         {"debug_texcoord", trace_shader_type::debug_texcoord},
+        {"pathtrace_guided", trace_shader_type::pathtrace_guided},
+        {"pathtrace_cached", trace_shader_type::pathtrace_cached},
     };
     return names;
 }
@@ -6764,6 +7327,8 @@ enum_names<trace_rng_type>() {
     static auto names = std::vector<std::pair<std::string, trace_rng_type>>{
         {"uniform", trace_rng_type::uniform},
         {"stratified", trace_rng_type::stratified},
+        {"sobol", trace_rng_type::sobol},
+        {"halton", trace_rng_type::halton},
     };
     return names;
 }
@@ -6816,6 +7381,28 @@ inline void visit(trace_params& val, Visitor&& visitor) {
     visitor(
         val.seed, visit_var{"seed", visit_var_type::value,
                       "Seed for the random number generators.", 0, 1000, ""});
+    visitor(val.guiding_fraction,
+        visit_var{"guiding_fraction", visit_var_type::value,
+            "Fraction of bounces sampled from the path guiding distribution.",
+            0, 1, ""});
+    visitor(val.guiding_memory,
+        visit_var{"guiding_memory", visit_var_type::value,
+            "Memory cap of the path guiding distribution in MB.", 1, 4096,
+            ""});
+    visitor(val.light_candidates,
+        visit_var{"light_candidates", visit_var_type::value,
+            "Number of candidate light samples resampled for direct lighting.",
+            1, 64, ""});
+    visitor(val.light_samples,
+        visit_var{"light_samples", visit_var_type::value,
+            "Number of light samples at the first hit.", 1, 16, ""});
+    visitor(val.indirect_light_samples,
+        visit_var{"indirect_light_samples", visit_var_type::value,
+            "Number of light samples at later hits.", 1, 16, ""});
+    visitor(val.cache_resolution,
+        visit_var{"cache_resolution", visit_var_type::value,
+            "Number of radiance cache cells along the scene diagonal.", 16,
+            1024, ""});
 }
 
 // #codegen end reflgen-trace